@@ -3,13 +3,19 @@
  *
  * Summarize per-user and per-group usage in a directory hierarchy.
  *
- * Specific to Linux thanks to the "ftw" functionality.
+ * Specific to Linux thanks to the "ftw" functionality and the use of
+ * statfs() to select a traversal profile per file system type.
  *
  */
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #include <ftw.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <grp.h>
 #include <errno.h>
@@ -18,10 +24,15 @@
 #include <stdbool.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <time.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 
 #ifndef ST_NBLOCKSIZE
 # ifdef S_BLKSIZE
@@ -31,6 +42,32 @@
 # endif
 #endif
 
+//
+// File system magic numbers (see statfs(2)); not all of these are present
+// in <linux/magic.h>:
+//
+#ifndef NFS_SUPER_MAGIC
+#define NFS_SUPER_MAGIC         0x6969
+#endif
+#ifndef LUSTRE_SUPER_MAGIC
+#define LUSTRE_SUPER_MAGIC      0x0BD00BD0
+#endif
+#ifndef GPFS_SUPER_MAGIC
+#define GPFS_SUPER_MAGIC        0x47504653
+#endif
+#ifndef EXT4_SUPER_MAGIC
+#define EXT4_SUPER_MAGIC        0xEF53
+#endif
+#ifndef XFS_SUPER_MAGIC
+#define XFS_SUPER_MAGIC         0x58465342
+#endif
+#ifndef BTRFS_SUPER_MAGIC
+#define BTRFS_SUPER_MAGIC       0x9123683E
+#endif
+#ifndef TMPFS_MAGIC
+#define TMPFS_MAGIC             0x01021994
+#endif
+
 //
 
 struct option cli_options[] = {
@@ -43,9 +80,21 @@ struct option cli_options[] = {
         { "progress-stride",    required_argument,  NULL,   'l' },
         { "unsorted",           no_argument,        NULL,   'S' },
         { "parameter",          required_argument,  NULL,   'P' },
+        { "profile",            required_argument,  NULL,   't' },
+        { "tune",               required_argument,  NULL,   'T' },
+        { "benchmark",          no_argument,        NULL,   'B' },
+        { "include",            required_argument,  NULL,   'i' },
+        { "exclude",            required_argument,  NULL,   'x' },
+        { "min-size",           required_argument,  NULL,   's' },
+        { "older-than",         required_argument,  NULL,   'o' },
+        { "user",               required_argument,  NULL,   'u' },
+        { "group",              required_argument,  NULL,   'g' },
+        { "history",            required_argument,  NULL,   'd' },
+        { "diff-against",       required_argument,  NULL,   'D' },
+        { "diff-count",         required_argument,  NULL,   'N' },
         { NULL,                 0,                  NULL,    0  }
     };
-const char *cli_options_str = "hqvHnpl:SP:";
+const char *cli_options_str = "hqvHnpl:SP:t:T:Bi:x:s:o:u:g:d:D:N:";
 
 //
 
@@ -102,6 +151,69 @@ const char* parameter_names[] = {
 #define DEFAULT_PROGRESS_STRIDE  10000
 #endif
 
+//
+
+typedef struct traversal_profile {
+    const char      *name;
+    const char      *description;
+    bool            should_use_nftw;        // legacy nftw() walk, readdir order
+    unsigned int    batch_size;             // directory entries stat'd per batch
+    bool            should_sort_by_inode;   // sort each batch by d_ino before stat
+    unsigned int    concurrency;            // threads issuing stat() per batch
+    unsigned int    max_open_fds;           // directory descriptors held open
+    bool            should_use_noatime;     // open directories with O_NOATIME
+} traversal_profile_t;
+
+enum {
+    profile_nftw = 0,
+    profile_generic = 1,
+    profile_local = 2,
+    profile_nfs = 3,
+    profile_lustre = 4,
+    profile_gpfs = 5,
+    profile_max = 6,
+    profile_auto = -1
+};
+
+const traversal_profile_t traversal_profiles[] = {
+    { "nftw",    "legacy nftw() walk in readdir order",                    true,     0, false, 1, 100, false },
+    { "generic", "batched walk for unrecognized file systems",             false, 1024, true,  1, 100, true  },
+    { "local",   "large inode-ordered batches for local disk",             false, 4096, true,  1, 100, true  },
+    { "nfs",     "readdir order (reuses READDIRPLUS attributes), threaded", false, 1024, false, 8,  64, false },
+    { "lustre",  "inode-ordered batches, threaded",                        false, 4096, true,  8,  64, true  },
+    { "gpfs",    "inode-ordered batches, threaded",                        false, 4096, true,  8,  64, true  },
+    { NULL,      NULL,                                                      false,    0, false, 0,   0, false }
+};
+
+typedef struct filesystem_type {
+    long            f_type;
+    const char      *name;
+    int             profile;
+} filesystem_type_t;
+
+const filesystem_type_t filesystem_types[] = {
+    { NFS_SUPER_MAGIC,      "nfs",      profile_nfs },
+    { LUSTRE_SUPER_MAGIC,   "lustre",   profile_lustre },
+    { GPFS_SUPER_MAGIC,     "gpfs",     profile_gpfs },
+    { EXT4_SUPER_MAGIC,     "ext2/3/4", profile_local },
+    { XFS_SUPER_MAGIC,      "xfs",      profile_local },
+    { BTRFS_SUPER_MAGIC,    "btrfs",    profile_local },
+    { TMPFS_MAGIC,          "tmpfs",    profile_local },
+    { 0,                    NULL,       profile_generic }
+};
+
+enum {
+    tune_batch_size = 1 << 0,
+    tune_sort_by_inode = 1 << 1,
+    tune_concurrency = 1 << 2,
+    tune_max_open_fds = 1 << 3,
+    tune_noatime = 1 << 4
+};
+
+#ifndef MAX_CONCURRENCY
+#define MAX_CONCURRENCY  256
+#endif
+
 static usage_tree_t     *by_uid = NULL;
 static usage_tree_t     *by_gid = NULL;
 static uint64_t         total_usage = 0;
@@ -113,6 +225,170 @@ static bool             should_show_progress = false;
 static uint64_t         progress_stride = DEFAULT_PROGRESS_STRIDE;
 static bool             should_sort = true;
 static unsigned int     parameter = parameter_actual;
+static int              selected_profiles[profile_max + 1] = { profile_auto };
+static unsigned int     selected_profile_count = 1;
+static traversal_profile_t  profile_tuning;
+static unsigned int     profile_tuning_mask = 0;
+static traversal_profile_t  active_profile;
+static bool             should_benchmark = false;
+
+//
+
+typedef struct filter_pattern {
+    const char      *pattern;
+    bool            should_match_path;      // else match the entry name only
+} filter_pattern_t;
+
+typedef enum {
+    filter_op_exclude = 0,      // any pattern matches:  prune the entry
+    filter_op_include,          // no pattern matches:  do not account the entry
+    filter_op_uid,              // st_uid not in list:  do not account the entry
+    filter_op_gid,              // st_gid not in list:  do not account the entry
+    filter_op_min_size,         // st_size below size:  do not account the entry
+    filter_op_older_than        // st_mtime not before cutoff:  do not account the entry
+} filter_opcode_t;
+
+typedef struct filter_insn {
+    filter_opcode_t         opcode;
+    unsigned int            n_operands;
+    union {
+        filter_pattern_t    *patterns;
+        int32_t             *entity_ids;
+        uint64_t            size;
+        time_t              mtime;
+    } operand;
+} filter_insn_t;
+
+typedef struct filter_program {
+    filter_insn_t   insns[filter_op_older_than + 1];
+    unsigned int    n_path_insns;           // insns[0 .. n_path_insns-1] need only the path
+    unsigned int    n_insns;                // the remainder need stat() info
+    bool            needs_path;             // some pattern matches the full path
+} filter_program_t;
+
+enum {
+    filter_accept = 0,          // account the entry (pending stat() predicates)
+    filter_skip = 1,            // do not account the entry, but descend into it
+    filter_prune = 2            // neither account nor descend into the entry
+};
+
+static filter_pattern_t *filter_excludes = NULL;
+static unsigned int     filter_exclude_count = 0;
+static filter_pattern_t *filter_includes = NULL;
+static unsigned int     filter_include_count = 0;
+static int32_t          *filter_uids = NULL;
+static unsigned int     filter_uid_count = 0;
+static int32_t          *filter_gids = NULL;
+static unsigned int     filter_gid_count = 0;
+static uint64_t         filter_min_size = 0;
+static bool             has_filter_min_size = false;
+static time_t           filter_older_than = 0;
+static bool             has_filter_older_than = false;
+static filter_program_t filter_program;
+
+//
+// The history file:  a file header followed by one record per scan, each
+// record being
+//
+//     history_scan_header_t
+//     path (NUL-terminated, padded to a multiple of 8 bytes)
+//     history_entry_t[n_uids]     (sorted by uid)
+//     history_entry_t[n_gids]     (sorted by gid)
+//     history_scan_trailer_t
+//
+// Records are only ever appended, and each links to the previous scan of
+// the same path (with the same parameter and filters) so a path's history
+// can be followed without touching the records for other paths.  The file
+// is mmap()'d so only the pages visited are read.
+//
+// Finding the most recent scan of a path uses the side index file
+// "<file>.idx", which maps each path (by hash) to the offset of its latest
+// record as of a given history file size.  Only records appended beyond that
+// size are visited, walking backwards from the end of the file by way of
+// the trailers.  Without a usable index the backward walk covers the whole
+// file; the index is rewritten on every append.
+//
+// A record torn by a crash mid-append is truncated away by the next append.
+//
+
+#define HISTORY_FILE_MAGIC      "dubugTS"
+#define HISTORY_FILE_VERSION    1
+#define HISTORY_SCAN_MAGIC      0x4E414353      // "SCAN"
+#define HISTORY_TRAILER_MAGIC   0x524C5254      // "TRLR"
+#define HISTORY_INDEX_MAGIC     "dubugIX"
+#define HISTORY_INDEX_VERSION   1
+#define HISTORY_INDEX_SUFFIX    ".idx"
+
+typedef struct history_file_header {
+    char            magic[8];
+    uint32_t        version;
+    uint32_t        header_size;
+} history_file_header_t;
+
+typedef struct history_scan_header {
+    uint32_t        magic;
+    uint32_t        parameter;
+    uint64_t        record_size;
+    uint64_t        previous_offset;        // 0 if this is the first such scan
+    uint64_t        path_hash;
+    uint64_t        filter_hash;
+    int64_t         scan_time;
+    uint64_t        total_usage;
+    uint64_t        item_count;
+    uint32_t        path_length;            // padded, including the NUL
+    uint32_t        n_uids;
+    uint32_t        n_gids;
+    uint32_t        reserved;
+} history_scan_header_t;
+
+typedef struct history_entry {
+    int32_t         entity_id;
+    uint32_t        reserved;
+    uint64_t        byte_usage;
+} history_entry_t;
+
+typedef struct history_scan_trailer {
+    uint64_t        record_size;
+    uint32_t        magic;
+    uint32_t        reserved;
+} history_scan_trailer_t;
+
+typedef struct history_index_header {
+    char            magic[8];
+    uint32_t        version;
+    uint32_t        n_entries;
+    uint64_t        covered_size;           // history file size when written
+} history_index_header_t;
+
+typedef struct history_index_entry {
+    uint64_t        path_hash;
+    uint64_t        filter_hash;
+    uint32_t        parameter;
+    uint32_t        reserved;
+    uint64_t        offset;                 // latest scan of the path
+} history_index_entry_t;
+
+typedef struct history_file {
+    int             fd;
+    const char      *base;
+    size_t          size;                   // through the last intact record
+    size_t          mapped_size;
+
+    char            *index_filename;
+    history_index_entry_t *index;           // sorted by key
+    unsigned int    n_index, index_capacity;
+    uint64_t        index_covered_size;     // 0 if there is no usable index
+} history_file_t;
+
+#ifndef DEFAULT_DIFF_COUNT
+#define DEFAULT_DIFF_COUNT      10
+#endif
+
+static const char       *history_filename = NULL;
+static bool             should_diff = false;
+static time_t           diff_against_time = 0;  // 0 => the most recent scan
+static unsigned int     diff_count = DEFAULT_DIFF_COUNT;
+static time_t           scan_time = 0;
 
 
 //
@@ -186,6 +462,465 @@ set_progress_stride(
 
 //
 
+int
+profile_lookup(
+    const char      *profile_name,
+    size_t          profile_name_len
+)
+{
+    const traversal_profile_t   *P = traversal_profiles;
+
+    if ( (profile_name_len == 4) && (strncasecmp(profile_name, "auto", 4) == 0) ) return profile_auto;
+    while ( P->name ) {
+        if ( (strlen(P->name) == profile_name_len) && (strncasecmp(profile_name, P->name, profile_name_len) == 0) ) return P - traversal_profiles;
+        P++;
+    }
+    return profile_max;
+}
+
+//
+
+bool
+set_profiles(
+    const char      *profile_list
+)
+{
+    selected_profile_count = 0;
+    while ( *profile_list ) {
+        const char  *end = strchrnul(profile_list, ',');
+        int         profile = profile_lookup(profile_list, end - profile_list);
+
+        if ( profile == profile_max ) return false;
+        if ( selected_profile_count > profile_max ) return false;
+        selected_profiles[selected_profile_count++] = profile;
+        profile_list = *end ? end + 1 : end;
+    }
+    return ( selected_profile_count > 0 );
+}
+
+//
+
+bool
+__parse_unsigned(
+    const char      *value_str,
+    unsigned int    min_value,
+    unsigned int    max_value,
+    unsigned int    *value
+)
+{
+    char                    *endptr = NULL;
+    unsigned long long int  v = strtoull(value_str, &endptr, 0);
+
+    if ( (endptr == value_str) || (*endptr) || (v < min_value) || (v > max_value) ) return false;
+    *value = (unsigned int)v;
+    return true;
+}
+
+bool
+__parse_boolean(
+    const char      *value_str,
+    bool            *value
+)
+{
+    if ( ! strcasecmp(value_str, "yes") || ! strcasecmp(value_str, "true") || ! strcmp(value_str, "1") ) {
+        *value = true;
+        return true;
+    }
+    if ( ! strcasecmp(value_str, "no") || ! strcasecmp(value_str, "false") || ! strcmp(value_str, "0") ) {
+        *value = false;
+        return true;
+    }
+    return false;
+}
+
+bool
+set_profile_tuning(
+    const char      *tuning_str
+)
+{
+    const char      *value_str = strchr(tuning_str, '=');
+    size_t          key_len;
+
+    if ( ! value_str ) return false;
+    key_len = value_str++ - tuning_str;
+
+    if ( (key_len == 5) && ! strncasecmp(tuning_str, "batch", key_len) ) {
+        if ( ! __parse_unsigned(value_str, 1, 1 << 24, &profile_tuning.batch_size) ) return false;
+        profile_tuning_mask |= tune_batch_size;
+    }
+    else if ( (key_len == 4) && ! strncasecmp(tuning_str, "sort", key_len) ) {
+        if ( ! __parse_boolean(value_str, &profile_tuning.should_sort_by_inode) ) return false;
+        profile_tuning_mask |= tune_sort_by_inode;
+    }
+    else if ( (key_len == 11) && ! strncasecmp(tuning_str, "concurrency", key_len) ) {
+        if ( ! __parse_unsigned(value_str, 1, MAX_CONCURRENCY, &profile_tuning.concurrency) ) return false;
+        profile_tuning_mask |= tune_concurrency;
+    }
+    else if ( (key_len == 3) && ! strncasecmp(tuning_str, "fds", key_len) ) {
+        if ( ! __parse_unsigned(value_str, 1, 1 << 16, &profile_tuning.max_open_fds) ) return false;
+        profile_tuning_mask |= tune_max_open_fds;
+    }
+    else if ( (key_len == 7) && ! strncasecmp(tuning_str, "noatime", key_len) ) {
+        if ( ! __parse_boolean(value_str, &profile_tuning.should_use_noatime) ) return false;
+        profile_tuning_mask |= tune_noatime;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+//
+
+void
+select_profile(
+    const char      *root_path,
+    int             profile
+)
+{
+    const char      *fs_name = NULL;
+
+    if ( profile == profile_auto ) {
+        struct statfs           fs_info;
+        const filesystem_type_t *F = filesystem_types;
+
+        if ( statfs(root_path, &fs_info) == 0 ) {
+            while ( F->name && (F->f_type != (long)fs_info.f_type) ) F++;
+        } else {
+            while ( F->name ) F++;
+            if ( is_verbose(verbosity_warning) ) fprintf(stderr, "[WARNING] unable to determine file system type of %s (errno = %d)\n", root_path, errno);
+        }
+        fs_name = F->name ? F->name : "unrecognized";
+        profile = F->profile;
+    }
+    active_profile = traversal_profiles[profile];
+
+    // Apply any command-line tuning atop the profile:
+    if ( profile_tuning_mask & tune_batch_size ) active_profile.batch_size = profile_tuning.batch_size;
+    if ( profile_tuning_mask & tune_sort_by_inode ) active_profile.should_sort_by_inode = profile_tuning.should_sort_by_inode;
+    if ( profile_tuning_mask & tune_concurrency ) active_profile.concurrency = profile_tuning.concurrency;
+    if ( profile_tuning_mask & tune_max_open_fds ) active_profile.max_open_fds = profile_tuning.max_open_fds;
+    if ( profile_tuning_mask & tune_noatime ) active_profile.should_use_noatime = profile_tuning.should_use_noatime;
+
+    if ( is_verbose(verbosity_info) ) {
+        if ( fs_name ) {
+            fprintf(stderr, "[INFO] Using traversal profile %s for %s file system at %s\n", active_profile.name, fs_name, root_path);
+        } else {
+            fprintf(stderr, "[INFO] Using traversal profile %s for %s\n", active_profile.name, root_path);
+        }
+        if ( ! active_profile.should_use_nftw ) {
+            fprintf(stderr, "[INFO]   batch=%u sort=%s concurrency=%u fds=%u noatime=%s\n",
+                    active_profile.batch_size, active_profile.should_sort_by_inode ? "yes" : "no",
+                    active_profile.concurrency, active_profile.max_open_fds,
+                    active_profile.should_use_noatime ? "yes" : "no"
+                );
+        } else {
+            fprintf(stderr, "[INFO]   fds=%u\n", active_profile.max_open_fds);
+        }
+    }
+}
+
+//
+
+void*
+__filter_append(
+    void            *array,
+    unsigned int    *count,
+    size_t          element_size,
+    const void      *element
+)
+{
+    char            *new_array = (char*)realloc(array, (*count + 1) * element_size);
+
+    if ( ! new_array ) {
+        perror("Unable to grow filter list");
+        exit(ENOMEM);
+    }
+    memcpy(new_array + (*count)++ * element_size, element, element_size);
+    return new_array;
+}
+
+//
+
+bool
+add_filter_pattern(
+    const char      *pattern,
+    bool            is_exclude
+)
+{
+    filter_pattern_t    new_pattern = { pattern, (strchr(pattern, '/') != NULL) };
+
+    if ( ! *pattern ) return false;
+    if ( is_exclude ) {
+        filter_excludes = (filter_pattern_t*)__filter_append(filter_excludes, &filter_exclude_count, sizeof(filter_pattern_t), &new_pattern);
+    } else {
+        filter_includes = (filter_pattern_t*)__filter_append(filter_includes, &filter_include_count, sizeof(filter_pattern_t), &new_pattern);
+    }
+    return true;
+}
+
+//
+
+bool
+set_filter_min_size(
+    const char      *size_str
+)
+{
+    static const char       *units = "KMGTP";
+    char                    *endptr = NULL;
+    const char              *unit;
+    unsigned long long int  value;
+
+    // strtoull() would happily negate a leading '-':
+    while ( isspace((unsigned char)*size_str) ) size_str++;
+    if ( *size_str == '-' ) return false;
+    errno = 0;
+    value = strtoull(size_str, &endptr, 0);
+    if ( (endptr == size_str) || (errno == ERANGE) ) return false;
+    if ( *endptr && (unit = strchr(units, toupper((unsigned char)*endptr))) ) {
+        int         shift = 10 * (unit - units + 1);
+
+        if ( value > (ULLONG_MAX >> shift) ) return false;
+        value <<= shift;
+        endptr++;
+        if ( (*endptr == 'i') && (*(endptr + 1) == 'B') ) endptr += 2;
+    }
+    if ( *endptr ) return false;
+    filter_min_size = value;
+    has_filter_min_size = true;
+    return true;
+}
+
+//
+
+bool
+__parse_age(
+    const char      *age_str,
+    time_t          *age
+)
+{
+    static const char       *units = "smhdw";
+    static const unsigned long long int unit_seconds[] = { 1, 60, 3600, 86400, 7 * 86400 };
+    char                    *endptr = NULL;
+    const char              *unit;
+    unsigned long long int  value, multiplier = 86400;
+
+    while ( isspace((unsigned char)*age_str) ) age_str++;
+    if ( *age_str == '-' ) return false;
+    errno = 0;
+    value = strtoull(age_str, &endptr, 0);
+    if ( (endptr == age_str) || (errno == ERANGE) ) return false;
+
+    // Days if no unit is given:
+    if ( *endptr ) {
+        if ( ! (unit = strchr(units, *endptr)) ) return false;
+        multiplier = unit_seconds[unit - units];
+        endptr++;
+    }
+    if ( *endptr || (value > (unsigned long long int)INT64_MAX / multiplier) ) return false;
+    *age = (time_t)(value * multiplier);
+    return true;
+}
+
+bool
+set_filter_older_than(
+    const char      *age_str
+)
+{
+    if ( ! __parse_age(age_str, &filter_older_than) ) return false;
+    has_filter_older_than = true;
+    return true;
+}
+
+//
+
+bool
+add_filter_entities(
+    const char      *entity_list,
+    bool            is_group
+)
+{
+    char            entity_name[256];
+
+    if ( ! *entity_list ) return false;
+    while ( *entity_list ) {
+        const char  *end = strchrnul(entity_list, ',');
+        size_t      entity_name_len = end - entity_list;
+        char        *endptr = NULL;
+        long        entity_id;
+
+        if ( ! entity_name_len || (entity_name_len >= sizeof(entity_name)) ) return false;
+        memcpy(entity_name, entity_list, entity_name_len);
+        entity_name[entity_name_len] = '\0';
+
+        // Numeric ids are taken as-is, anything else must resolve:
+        entity_id = strtol(entity_name, &endptr, 10);
+        if ( *endptr ) {
+            if ( is_group ) {
+                struct group    *gentry = getgrnam(entity_name);
+
+                if ( ! gentry ) return false;
+                entity_id = gentry->gr_gid;
+            } else {
+                struct passwd   *uentry = getpwnam(entity_name);
+
+                if ( ! uentry ) return false;
+                entity_id = uentry->pw_uid;
+            }
+        }
+
+        int32_t     new_id = (int32_t)entity_id;
+
+        if ( is_group ) {
+            filter_gids = (int32_t*)__filter_append(filter_gids, &filter_gid_count, sizeof(int32_t), &new_id);
+        } else {
+            filter_uids = (int32_t*)__filter_append(filter_uids, &filter_uid_count, sizeof(int32_t), &new_id);
+        }
+        entity_list = *end ? end + 1 : end;
+    }
+    return true;
+}
+
+//
+
+void
+filter_compile(void)
+{
+    filter_insn_t   *insn = filter_program.insns;
+    unsigned int    i;
+
+    memset(&filter_program, 0, sizeof(filter_program));
+
+    // Path predicates first, exclusions ahead of inclusions so pruning
+    // happens as early as possible:
+    if ( filter_exclude_count ) {
+        insn->opcode = filter_op_exclude;
+        insn->n_operands = filter_exclude_count;
+        insn->operand.patterns = filter_excludes;
+        insn++;
+    }
+    if ( filter_include_count ) {
+        insn->opcode = filter_op_include;
+        insn->n_operands = filter_include_count;
+        insn->operand.patterns = filter_includes;
+        insn++;
+    }
+    filter_program.n_path_insns = insn - filter_program.insns;
+    for ( i = 0; i < filter_exclude_count; i++ ) if ( filter_excludes[i].should_match_path ) filter_program.needs_path = true;
+    for ( i = 0; i < filter_include_count; i++ ) if ( filter_includes[i].should_match_path ) filter_program.needs_path = true;
+
+    // Then the stat() predicates:
+    if ( filter_uid_count ) {
+        insn->opcode = filter_op_uid;
+        insn->n_operands = filter_uid_count;
+        insn->operand.entity_ids = filter_uids;
+        insn++;
+    }
+    if ( filter_gid_count ) {
+        insn->opcode = filter_op_gid;
+        insn->n_operands = filter_gid_count;
+        insn->operand.entity_ids = filter_gids;
+        insn++;
+    }
+    if ( has_filter_min_size ) {
+        insn->opcode = filter_op_min_size;
+        insn->operand.size = filter_min_size;
+        insn++;
+    }
+    if ( has_filter_older_than ) {
+        insn->opcode = filter_op_older_than;
+        insn->operand.mtime = time(NULL) - filter_older_than;
+        insn++;
+    }
+    filter_program.n_insns = insn - filter_program.insns;
+}
+
+//
+
+uint64_t
+__fnv1a_hash(
+    uint64_t        hash,
+    const void      *data,
+    size_t          data_len
+)
+{
+    const unsigned char *p = (const unsigned char*)data;
+
+    while ( data_len-- ) {
+        hash ^= *p++;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+#define FNV1A_HASH_INIT     0xCBF29CE484222325ULL
+
+//
+
+uint64_t
+filter_signature(void)
+{
+    uint64_t        hash = FNV1A_HASH_INIT;
+    unsigned int    i;
+
+    // Scans are only comparable if they were filtered identically:
+    for ( i = 0; i < filter_exclude_count; i++ ) hash = __fnv1a_hash(hash, filter_excludes[i].pattern, strlen(filter_excludes[i].pattern) + 1);
+    hash = __fnv1a_hash(hash, "|", 1);
+    for ( i = 0; i < filter_include_count; i++ ) hash = __fnv1a_hash(hash, filter_includes[i].pattern, strlen(filter_includes[i].pattern) + 1);
+    hash = __fnv1a_hash(hash, "|", 1);
+    hash = __fnv1a_hash(hash, filter_uids, filter_uid_count * sizeof(int32_t));
+    hash = __fnv1a_hash(hash, "|", 1);
+    hash = __fnv1a_hash(hash, filter_gids, filter_gid_count * sizeof(int32_t));
+    hash = __fnv1a_hash(hash, "|", 1);
+    if ( has_filter_min_size ) hash = __fnv1a_hash(hash, &filter_min_size, sizeof(filter_min_size));
+    hash = __fnv1a_hash(hash, "|", 1);
+    if ( has_filter_older_than ) hash = __fnv1a_hash(hash, &filter_older_than, sizeof(filter_older_than));
+    return hash;
+}
+
+//
+
+bool
+set_diff_against(
+    const char      *when_str
+)
+{
+    struct tm       when_tm;
+    const char      *endptr;
+    time_t          age;
+
+    should_diff = true;
+    if ( strcasecmp(when_str, "last") == 0 ) {
+        diff_against_time = 0;
+        return true;
+    }
+
+    // An absolute date (and optional time):
+    memset(&when_tm, 0, sizeof(when_tm));
+    if ( (endptr = strptime(when_str, "%Y-%m-%d", &when_tm)) ) {
+        if ( *endptr == 'T' || *endptr == ' ' ) {
+            endptr = strptime(endptr + 1, "%H:%M", &when_tm);
+            if ( endptr && (*endptr == ':') ) endptr = strptime(endptr + 1, "%S", &when_tm);
+        } else {
+            // Through the end of that day:
+            when_tm.tm_hour = 23;
+            when_tm.tm_min = 59;
+            when_tm.tm_sec = 59;
+        }
+        if ( ! endptr || *endptr ) return false;
+        when_tm.tm_isdst = -1;
+        diff_against_time = mktime(&when_tm);
+        return ( diff_against_time > 0 );
+    }
+
+    // An age relative to now:
+    if ( ! __parse_age(when_str, &age) ) return false;
+    diff_against_time = time(NULL) - age;
+    return ( diff_against_time > 0 );
+}
+
+//
+
 usage_tree_t*
 usage_tree_create(
     entity_id_to_name_fn    entity_to_name
@@ -446,103 +1181,1322 @@ uid_to_uname(
 
 //
 
-int
-nftw_callback(
-    const char          *fpath,
-    const struct stat   *finfo,
-    int                 typeflag,
-    struct FTW          *ftw_info
+bool
+__filter_match_patterns(
+    const filter_insn_t *insn,
+    const char          *path,
+    const char          *name
 )
 {
-    usage_record_t      *r;
+    unsigned int        i;
 
-    if ( typeflag == FTW_DNR ) {
-        if ( is_verbose(verbosity_warning) ) fprintf(stderr, "[WARNING] cannot descend into directory: %s\n", fpath);
-        return 0;
-    }
-    if ( typeflag == FTW_NS ) {
-        if ( is_verbose(verbosity_warning) ) fprintf(stderr, "[WARNING] unresolvable symlink: %s\n", fpath);
-        return 0;
-    }
+    for ( i = 0; i < insn->n_operands; i++ ) {
+        const filter_pattern_t  *P = &insn->operand.patterns[i];
 
-    if ( is_verbose(verbosity_debug) && typeflag == FTW_D ) fprintf(stderr, "[DEBUG] %s\n", fpath);
-    
-    uint64_t        size;
-    
-    switch ( parameter ) {
-        case parameter_actual:
-            size = finfo->st_blocks * ST_NBLOCKSIZE;
-            break;
-        case parameter_size:
-            size = finfo->st_size;
-            break;
-        case parameter_blocks:
-            size = finfo->st_blocks;
-            break;
+        if ( fnmatch(P->pattern, P->should_match_path ? path : name, 0) == 0 ) return true;
     }
-    total_usage += size;
-    item_count++;
-    r = usage_tree_lookup_or_add(by_uid, finfo->st_uid);
-    if ( r ) r->byte_usage += size;
-    r = usage_tree_lookup_or_add(by_gid, finfo->st_gid);
-    if ( r ) r->byte_usage += size;
-
-    return 0;
+    return false;
 }
 
-//
-
 int
-nftw_progress_callback(
-    const char          *fpath,
-    const struct stat   *finfo,
-    int                 typeflag,
-    struct FTW          *ftw_info
+filter_evaluate_path(
+    const char          *path,
+    const char          *name
+)
+{
+    const filter_insn_t *insn = filter_program.insns;
+    const filter_insn_t *insn_end = insn + filter_program.n_path_insns;
+
+    while ( insn < insn_end ) {
+        switch ( insn->opcode ) {
+            case filter_op_exclude:
+                if ( __filter_match_patterns(insn, path, name) ) return filter_prune;
+                break;
+            case filter_op_include:
+                if ( ! __filter_match_patterns(insn, path, name) ) return filter_skip;
+                break;
+            default:
+                break;
+        }
+        insn++;
+    }
+    return filter_accept;
+}
+
+bool
+__filter_match_entity_id(
+    const filter_insn_t *insn,
+    int32_t             entity_id
+)
+{
+    unsigned int        i;
+
+    for ( i = 0; i < insn->n_operands; i++ ) if ( insn->operand.entity_ids[i] == entity_id ) return true;
+    return false;
+}
+
+bool
+filter_evaluate_stat(
+    const struct stat   *finfo
+)
+{
+    const filter_insn_t *insn = filter_program.insns + filter_program.n_path_insns;
+    const filter_insn_t *insn_end = filter_program.insns + filter_program.n_insns;
+
+    while ( insn < insn_end ) {
+        switch ( insn->opcode ) {
+            case filter_op_uid:
+                if ( ! __filter_match_entity_id(insn, finfo->st_uid) ) return false;
+                break;
+            case filter_op_gid:
+                if ( ! __filter_match_entity_id(insn, finfo->st_gid) ) return false;
+                break;
+            case filter_op_min_size:
+                if ( (uint64_t)finfo->st_size < insn->operand.size ) return false;
+                break;
+            case filter_op_older_than:
+                if ( finfo->st_mtime >= insn->operand.mtime ) return false;
+                break;
+            default:
+                break;
+        }
+        insn++;
+    }
+    return true;
+}
+
+//
+
+void
+account_usage(
+    const struct stat   *finfo
 )
 {
     usage_record_t      *r;
+    uint64_t            size;
+
+    switch ( parameter ) {
+        case parameter_actual:
+            size = finfo->st_blocks * ST_NBLOCKSIZE;
+            break;
+        case parameter_size:
+            size = finfo->st_size;
+            break;
+        case parameter_blocks:
+            size = finfo->st_blocks;
+            break;
+    }
+    total_usage += size;
+    item_count++;
+    r = usage_tree_lookup_or_add(by_uid, finfo->st_uid);
+    if ( r ) r->byte_usage += size;
+    r = usage_tree_lookup_or_add(by_gid, finfo->st_gid);
+    if ( r ) r->byte_usage += size;
+
+    if ( should_show_progress && ((item_count % progress_stride) == 0) ) {
+        if ( is_verbose(verbosity_info) ) {
+            fprintf(stderr, "[INFO]   %12llu items scanned...\n", (unsigned long long)item_count);
+        } else {
+            printf("... %llu items scanned...\n", (unsigned long long)item_count);
+        }
+    }
+}
+
+//
+
+int
+nftw_callback(
+    const char          *fpath,
+    const struct stat   *finfo,
+    int                 typeflag,
+    struct FTW          *ftw_info
+)
+{
+    if ( typeflag == FTW_DNR ) {
+        if ( is_verbose(verbosity_warning) ) fprintf(stderr, "[WARNING] cannot descend into directory: %s\n", fpath);
+        return FTW_CONTINUE;
+    }
+    if ( typeflag == FTW_NS ) {
+        if ( is_verbose(verbosity_warning) ) fprintf(stderr, "[WARNING] unresolvable symlink: %s\n", fpath);
+        return FTW_CONTINUE;
+    }
+
+    // The nftw() walk has already stat'd the entry, but excluded directories
+    // can at least be pruned before descent:
+    if ( filter_program.n_path_insns ) {
+        switch ( filter_evaluate_path(fpath, fpath + ftw_info->base) ) {
+            case filter_prune:
+                return ( typeflag == FTW_D ) ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+            case filter_skip:
+                if ( is_verbose(verbosity_debug) && typeflag == FTW_D ) fprintf(stderr, "[DEBUG] %s\n", fpath);
+                return FTW_CONTINUE;
+        }
+    }
+
+    if ( is_verbose(verbosity_debug) && typeflag == FTW_D ) fprintf(stderr, "[DEBUG] %s\n", fpath);
+
+    if ( filter_evaluate_stat(finfo) ) account_usage(finfo);
+    return FTW_CONTINUE;
+}
+
+//
+// The batched walker:  each directory is read in batches of entries which
+// are (optionally) sorted by inode number and then stat'd -- possibly by a
+// pool of threads -- before being accounted in batch order.  Network file
+// systems favor stat() calls issued in inode order or concurrently, and
+// reading an entire batch before any stat() keeps READDIRPLUS attributes
+// cached on NFS clients.
+//
+
+typedef struct walk_entry {
+    ino_t           d_ino;
+    size_t          name_offset;
+    bool            should_account;     // passed the path predicates
+    int             stat_errno;
+    struct stat     finfo;
+} walk_entry_t;
+
+typedef struct walk_batch {
+    walk_entry_t    *entries;
+    unsigned int    count, capacity;
+    char            *names;
+    size_t          names_length, names_capacity;
+} walk_batch_t;
+
+static char         *walk_path = NULL;
+static size_t       walk_path_length = 0, walk_path_capacity = 0;
+static dev_t        walk_root_dev;
+
+//
+
+void
+__walk_path_push(
+    const char      *name
+)
+{
+    size_t          name_length = strlen(name);
+    size_t          needed = walk_path_length + name_length + 2;
+
+    if ( needed > walk_path_capacity ) {
+        size_t      new_capacity = walk_path_capacity ? walk_path_capacity : 4096;
+        char        *new_path;
+
+        while ( new_capacity < needed ) new_capacity *= 2;
+        new_path = (char*)realloc(walk_path, new_capacity);
+        if ( ! new_path ) {
+            perror("Unable to grow traversal path buffer");
+            exit(ENOMEM);
+        }
+        walk_path = new_path;
+        walk_path_capacity = new_capacity;
+    }
+    if ( walk_path_length && (walk_path[walk_path_length - 1] != '/') ) walk_path[walk_path_length++] = '/';
+    memcpy(walk_path + walk_path_length, name, name_length + 1);
+    walk_path_length += name_length;
+}
+
+void
+__walk_path_pop(
+    size_t          prior_length
+)
+{
+    walk_path_length = prior_length;
+    walk_path[walk_path_length] = '\0';
+}
+
+//
+
+void
+walk_batch_push(
+    walk_batch_t    *batch,
+    ino_t           d_ino,
+    const char      *name,
+    bool            should_account,
+    const struct stat *finfo
+)
+{
+    size_t          name_length = strlen(name) + 1;
+
+    if ( batch->count == batch->capacity ) {
+        unsigned int    new_capacity = batch->capacity ? 2 * batch->capacity : 64;
+        walk_entry_t    *new_entries = (walk_entry_t*)realloc(batch->entries, new_capacity * sizeof(walk_entry_t));
+
+        if ( ! new_entries ) {
+            perror("Unable to grow directory entry batch");
+            exit(ENOMEM);
+        }
+        batch->entries = new_entries;
+        batch->capacity = new_capacity;
+    }
+    if ( batch->names_length + name_length > batch->names_capacity ) {
+        size_t      new_capacity = batch->names_capacity ? batch->names_capacity : 4096;
+        char        *new_names;
+
+        while ( new_capacity < batch->names_length + name_length ) new_capacity *= 2;
+        new_names = (char*)realloc(batch->names, new_capacity);
+        if ( ! new_names ) {
+            perror("Unable to grow directory entry batch");
+            exit(ENOMEM);
+        }
+        batch->names = new_names;
+        batch->names_capacity = new_capacity;
+    }
+
+    walk_entry_t    *entry = &batch->entries[batch->count++];
+
+    entry->d_ino = d_ino;
+    entry->name_offset = batch->names_length;
+    entry->should_account = should_account;
+    entry->stat_errno = 0;
+    if ( finfo ) entry->finfo = *finfo;
+    memcpy(batch->names + batch->names_length, name, name_length);
+    batch->names_length += name_length;
+}
+
+void
+walk_batch_reset(
+    walk_batch_t    *batch
+)
+{
+    batch->count = 0;
+    batch->names_length = 0;
+}
+
+void
+walk_batch_free(
+    walk_batch_t    *batch
+)
+{
+    if ( batch->entries ) free((void*)batch->entries);
+    if ( batch->names ) free((void*)batch->names);
+    memset(batch, 0, sizeof(*batch));
+}
+
+//
+
+int
+__walk_entry_compare_by_inode(
+    const void      *e1,
+    const void      *e2
+)
+{
+    ino_t           i1 = ((const walk_entry_t*)e1)->d_ino;
+    ino_t           i2 = ((const walk_entry_t*)e2)->d_ino;
+
+    return ( i1 < i2 ) ? -1 : ( ( i1 > i2 ) ? 1 : 0 );
+}
+
+//
+
+typedef struct stat_pool {
+    pthread_t       *threads;
+    unsigned int    n_threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  work_ready, work_done;
+    unsigned long   generation;
+    unsigned int    n_busy;
+    bool            should_exit;
+
+    int             dir_fd;
+    walk_batch_t    *batch;
+    unsigned int    next_index;
+} stat_pool_t;
+
+static stat_pool_t  *stat_pool = NULL;
+
+void
+__stat_pool_run(
+    int             dir_fd,
+    walk_batch_t    *batch,
+    unsigned int    *next_index
+)
+{
+    unsigned int    i;
+
+    while ( (i = __sync_fetch_and_add(next_index, 1)) < batch->count ) {
+        walk_entry_t    *entry = &batch->entries[i];
+
+        entry->stat_errno = 0;
+        if ( fstatat(dir_fd, batch->names + entry->name_offset, &entry->finfo, AT_SYMLINK_NOFOLLOW) != 0 ) entry->stat_errno = errno;
+    }
+}
+
+void*
+__stat_pool_worker(
+    void            *context
+)
+{
+    stat_pool_t     *pool = (stat_pool_t*)context;
+    unsigned long   generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while ( true ) {
+        while ( (pool->generation == generation) && ! pool->should_exit ) pthread_cond_wait(&pool->work_ready, &pool->lock);
+        if ( pool->should_exit ) break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        __stat_pool_run(pool->dir_fd, pool->batch, &pool->next_index);
+
+        pthread_mutex_lock(&pool->lock);
+        if ( --pool->n_busy == 0 ) pthread_cond_signal(&pool->work_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+stat_pool_t*
+stat_pool_create(
+    unsigned int    concurrency
+)
+{
+    stat_pool_t     *new_pool = (stat_pool_t*)malloc(sizeof(stat_pool_t));
+
+    if ( ! new_pool ) {
+        perror("Unable to allocate stat() thread pool");
+        exit(ENOMEM);
+    }
+    memset(new_pool, 0, sizeof(*new_pool));
+    pthread_mutex_init(&new_pool->lock, NULL);
+    pthread_cond_init(&new_pool->work_ready, NULL);
+    pthread_cond_init(&new_pool->work_done, NULL);
+
+    // The calling thread participates in each batch, too:
+    new_pool->threads = (pthread_t*)malloc((concurrency - 1) * sizeof(pthread_t));
+    if ( ! new_pool->threads ) {
+        perror("Unable to allocate stat() thread pool");
+        exit(ENOMEM);
+    }
+    while ( new_pool->n_threads < concurrency - 1 ) {
+        if ( pthread_create(&new_pool->threads[new_pool->n_threads], NULL, __stat_pool_worker, new_pool) != 0 ) {
+            if ( is_verbose(verbosity_warning) ) fprintf(stderr, "[WARNING] only able to start %u stat() threads\n", new_pool->n_threads);
+            break;
+        }
+        new_pool->n_threads++;
+    }
+    return new_pool;
+}
+
+void
+stat_pool_destroy(
+    stat_pool_t     *a_pool
+)
+{
+    unsigned int    i;
+
+    pthread_mutex_lock(&a_pool->lock);
+    a_pool->should_exit = true;
+    pthread_cond_broadcast(&a_pool->work_ready);
+    pthread_mutex_unlock(&a_pool->lock);
+    for ( i = 0; i < a_pool->n_threads; i++ ) pthread_join(a_pool->threads[i], NULL);
+
+    pthread_cond_destroy(&a_pool->work_done);
+    pthread_cond_destroy(&a_pool->work_ready);
+    pthread_mutex_destroy(&a_pool->lock);
+    free((void*)a_pool->threads);
+    free((void*)a_pool);
+}
+
+void
+stat_pool_stat_batch(
+    stat_pool_t     *a_pool,
+    int             dir_fd,
+    walk_batch_t    *batch
+)
+{
+    unsigned int    next_index = 0;
+
+    // Not worth waking the workers for a handful of entries:
+    if ( ! a_pool || ! a_pool->n_threads || (batch->count < 2 * (a_pool->n_threads + 1)) ) {
+        __stat_pool_run(dir_fd, batch, &next_index);
+        return;
+    }
+    pthread_mutex_lock(&a_pool->lock);
+    a_pool->dir_fd = dir_fd;
+    a_pool->batch = batch;
+    a_pool->next_index = 0;
+    a_pool->n_busy = a_pool->n_threads;
+    a_pool->generation++;
+    pthread_cond_broadcast(&a_pool->work_ready);
+    pthread_mutex_unlock(&a_pool->lock);
+
+    __stat_pool_run(dir_fd, batch, &a_pool->next_index);
+
+    pthread_mutex_lock(&a_pool->lock);
+    while ( a_pool->n_busy ) pthread_cond_wait(&a_pool->work_done, &a_pool->lock);
+    pthread_mutex_unlock(&a_pool->lock);
+}
+
+//
+
+void
+walk_process_batch(
+    int             dir_fd,
+    walk_batch_t    *batch,
+    walk_batch_t    *subdirs
+)
+{
+    unsigned int    i;
+
+    if ( active_profile.should_sort_by_inode ) qsort(batch->entries, batch->count, sizeof(walk_entry_t), __walk_entry_compare_by_inode);
+    stat_pool_stat_batch(stat_pool, dir_fd, batch);
+
+    for ( i = 0; i < batch->count; i++ ) {
+        walk_entry_t    *entry = &batch->entries[i];
+        const char      *name = batch->names + entry->name_offset;
+
+        if ( entry->stat_errno ) {
+            if ( is_verbose(verbosity_warning) ) fprintf(stderr, "[WARNING] unable to stat %s/%s (errno = %d)\n", walk_path, name, entry->stat_errno);
+            continue;
+        }
+        // Do not cross mount points:
+        if ( entry->finfo.st_dev != walk_root_dev ) continue;
+
+        // Directories are accounted once they have been opened:
+        if ( S_ISDIR(entry->finfo.st_mode) ) {
+            walk_batch_push(subdirs, entry->d_ino, name, entry->should_account, &entry->finfo);
+        }
+        else if ( entry->should_account && filter_evaluate_stat(&entry->finfo) ) {
+            account_usage(&entry->finfo);
+        }
+    }
+}
+
+//
+
+int
+__walk_open_directory(
+    int             parent_fd,
+    const char      *name
+)
+{
+    int             flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    int             fd;
+
+    // Unless we own the directory (or are root) O_NOATIME is not permitted:
+    if ( active_profile.should_use_noatime ) {
+        fd = openat(parent_fd, name, flags | O_NOATIME);
+        if ( (fd >= 0) || (errno != EPERM) ) return fd;
+    }
+    return openat(parent_fd, name, flags);
+}
+
+int
+walk_directory(
+    int                 parent_fd,
+    const char          *name,
+    const struct stat   *finfo,
+    bool                should_account,
+    unsigned int        depth
+)
+{
+    walk_batch_t        batch, subdirs;
+    struct dirent       *dentry;
+    DIR                 *dir;
+    int                 dir_fd, dir_stream_fd = -1, rc = 0;
+    unsigned int        i;
+
+    // With no parent descriptor, open by the full path:
+    dir_fd = __walk_open_directory(parent_fd, (parent_fd == AT_FDCWD) ? walk_path : name);
+    if ( dir_fd >= 0 ) dir_stream_fd = dup(dir_fd);
+    if ( (dir_fd < 0) || (dir_stream_fd < 0) || ! (dir = fdopendir(dir_stream_fd)) ) {
+        if ( dir_stream_fd >= 0 ) close(dir_stream_fd);
+        if ( dir_fd >= 0 ) close(dir_fd);
+        if ( is_verbose(verbosity_warning) ) fprintf(stderr, "[WARNING] cannot descend into directory: %s\n", walk_path);
+        return 0;
+    }
+    if ( is_verbose(verbosity_debug) ) fprintf(stderr, "[DEBUG] %s\n", walk_path);
+    if ( should_account && filter_evaluate_stat(finfo) ) account_usage(finfo);
+
+    memset(&batch, 0, sizeof(batch));
+    memset(&subdirs, 0, sizeof(subdirs));
+    while ( true ) {
+        errno = 0;
+        if ( ! (dentry = readdir(dir)) ) {
+            if ( errno && is_verbose(verbosity_warning) ) fprintf(stderr, "[WARNING] error while reading directory %s (errno = %d)\n", walk_path, errno);
+            break;
+        }
+        if ( (dentry->d_name[0] == '.') && (! dentry->d_name[1] || ((dentry->d_name[1] == '.') && ! dentry->d_name[2])) ) continue;
+
+        // Path predicates are evaluated before the entry is ever stat'd:
+        int             filter_result = filter_accept;
+
+        if ( filter_program.n_path_insns ) {
+            size_t      prior_length = walk_path_length;
+
+            if ( filter_program.needs_path ) __walk_path_push(dentry->d_name);
+            filter_result = filter_evaluate_path(walk_path, dentry->d_name);
+            if ( filter_program.needs_path ) __walk_path_pop(prior_length);
+
+            if ( filter_result == filter_prune ) continue;
+
+            // Only directories need a stat() if they won't be accounted:
+            if ( (filter_result == filter_skip) && (dentry->d_type != DT_DIR) && (dentry->d_type != DT_UNKNOWN) ) continue;
+        }
+        walk_batch_push(&batch, dentry->d_ino, dentry->d_name, (filter_result == filter_accept), NULL);
+        if ( batch.count >= active_profile.batch_size ) {
+            walk_process_batch(dir_fd, &batch, &subdirs);
+            walk_batch_reset(&batch);
+        }
+    }
+    if ( batch.count ) walk_process_batch(dir_fd, &batch, &subdirs);
+    walk_batch_free(&batch);
+    closedir(dir);
+
+    // Beyond the descriptor budget, subdirectories are opened by full path:
+    if ( depth + 1 >= active_profile.max_open_fds ) {
+        close(dir_fd);
+        dir_fd = AT_FDCWD;
+    }
+    for ( i = 0; (rc == 0) && (i < subdirs.count); i++ ) {
+        const char      *subdir_name = subdirs.names + subdirs.entries[i].name_offset;
+        size_t          prior_length = walk_path_length;
+
+        __walk_path_push(subdir_name);
+        rc = walk_directory(dir_fd, subdir_name, &subdirs.entries[i].finfo, subdirs.entries[i].should_account, depth + 1);
+        __walk_path_pop(prior_length);
+    }
+    walk_batch_free(&subdirs);
+    if ( dir_fd != AT_FDCWD ) close(dir_fd);
+    return rc;
+}
+
+int
+walk(
+    const char      *root_path
+)
+{
+    struct stat     finfo;
+    const char      *root_name = strrchr(root_path, '/');
+    bool            should_account = true;
+    int             rc = 0;
+
+    if ( filter_program.n_path_insns ) {
+        switch ( filter_evaluate_path(root_path, root_name ? root_name + 1 : root_path) ) {
+            case filter_prune:
+                return 0;
+            case filter_skip:
+                should_account = false;
+                break;
+        }
+    }
+    if ( lstat(root_path, &finfo) != 0 ) {
+        if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] unable to stat %s (errno = %d)\n", root_path, errno);
+        return -1;
+    }
+    walk_root_dev = finfo.st_dev;
+    if ( ! S_ISDIR(finfo.st_mode) ) {
+        if ( should_account && filter_evaluate_stat(&finfo) ) account_usage(&finfo);
+        return 0;
+    }
+
+    walk_path_length = 0;
+    __walk_path_push(root_path);
+    if ( active_profile.concurrency > 1 ) stat_pool = stat_pool_create(active_profile.concurrency);
+    rc = walk_directory(AT_FDCWD, root_path, &finfo, should_account, 0);
+    if ( stat_pool ) {
+        stat_pool_destroy(stat_pool);
+        stat_pool = NULL;
+    }
+    return rc;
+}
+
+//
+
+size_t
+__history_path_length(
+    const char      *path
+)
+{
+    return (strlen(path) + 1 + 7) & ~(size_t)7;
+}
+
+//
+
+const history_scan_header_t*
+__history_scan_at(
+    const history_file_t    *a_file,
+    uint64_t                offset
+)
+{
+    const history_scan_header_t     *scan;
+    const history_scan_trailer_t    *trailer;
+
+    // Records are always a multiple of 8 bytes in size:
+    if ( (offset & 7) || (offset < sizeof(history_file_header_t)) || (offset + sizeof(history_scan_header_t) > a_file->size) ) return NULL;
+    scan = (const history_scan_header_t*)(a_file->base + offset);
+    if ( (scan->magic != HISTORY_SCAN_MAGIC) || (scan->record_size > a_file->size - offset) ) return NULL;
+    if ( scan->record_size != sizeof(history_scan_header_t) + scan->path_length + ((uint64_t)scan->n_uids + scan->n_gids) * sizeof(history_entry_t) + sizeof(history_scan_trailer_t) ) return NULL;
+    trailer = (const history_scan_trailer_t*)(a_file->base + offset + scan->record_size - sizeof(history_scan_trailer_t));
+    if ( (trailer->magic != HISTORY_TRAILER_MAGIC) || (trailer->record_size != scan->record_size) ) return NULL;
+    return scan;
+}
+
+bool
+__history_scan_matches(
+    const history_scan_header_t *scan,
+    const char                  *path,
+    uint64_t                    path_hash,
+    uint64_t                    filter_hash
+)
+{
+    return ( (scan->path_hash == path_hash) && (scan->filter_hash == filter_hash) && (scan->parameter == parameter) && (strcmp((const char*)(scan + 1), path) == 0) );
+}
+
+//
+// Is the last record in the file intact?  If not, walk forward from the
+// file header and return the offset just past the last intact record.
+//
+uint64_t
+__history_intact_size(
+    const history_file_t    *a_file
+)
+{
+    const history_scan_trailer_t    *trailer;
+    const history_scan_header_t     *scan;
+    uint64_t                        end = a_file->size;
+
+    if ( end == sizeof(history_file_header_t) ) return end;
+    if ( ! (end & 7) && end >= sizeof(history_file_header_t) + sizeof(history_scan_header_t) + sizeof(history_scan_trailer_t) ) {
+        trailer = (const history_scan_trailer_t*)(a_file->base + end - sizeof(history_scan_trailer_t));
+        if ( (trailer->magic == HISTORY_TRAILER_MAGIC) && (trailer->record_size <= end - sizeof(history_file_header_t)) ) {
+            if ( (scan = __history_scan_at(a_file, end - trailer->record_size)) && (scan->record_size == trailer->record_size) ) return end;
+        }
+    }
+    end = sizeof(history_file_header_t);
+    while ( (scan = __history_scan_at(a_file, end)) ) end += scan->record_size;
+    return end;
+}
+
+//
+
+int
+__history_index_compare(
+    const history_index_entry_t *e1,
+    uint64_t                    path_hash,
+    uint64_t                    filter_hash,
+    uint32_t                    scan_parameter
+)
+{
+    if ( e1->path_hash != path_hash ) return ( e1->path_hash < path_hash ) ? -1 : 1;
+    if ( e1->filter_hash != filter_hash ) return ( e1->filter_hash < filter_hash ) ? -1 : 1;
+    if ( e1->parameter != scan_parameter ) return ( e1->parameter < scan_parameter ) ? -1 : 1;
+    return 0;
+}
+
+//
+// Binary search of the index; returns the position of the key or of where it
+// would be inserted.
+//
+unsigned int
+__history_index_search(
+    const history_file_t    *a_file,
+    uint64_t                path_hash,
+    uint64_t                filter_hash,
+    uint32_t                scan_parameter,
+    bool                    *is_found
+)
+{
+    unsigned int            lo = 0, hi = a_file->n_index;
+
+    *is_found = false;
+    while ( lo < hi ) {
+        unsigned int        mid = lo + (hi - lo) / 2;
+        int                 cmp = __history_index_compare(&a_file->index[mid], path_hash, filter_hash, scan_parameter);
+
+        if ( cmp == 0 ) {
+            *is_found = true;
+            return mid;
+        }
+        if ( cmp < 0 ) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void
+__history_index_set(
+    history_file_t  *a_file,
+    const history_scan_header_t *scan,
+    uint64_t        offset
+)
+{
+    bool            is_found;
+    unsigned int    i = __history_index_search(a_file, scan->path_hash, scan->filter_hash, scan->parameter, &is_found);
+
+    if ( ! is_found ) {
+        if ( a_file->n_index == a_file->index_capacity ) {
+            unsigned int            new_capacity = a_file->index_capacity ? 2 * a_file->index_capacity : 64;
+            history_index_entry_t   *new_index = (history_index_entry_t*)realloc(a_file->index, new_capacity * sizeof(history_index_entry_t));
+
+            if ( ! new_index ) {
+                perror("Unable to grow history index");
+                exit(ENOMEM);
+            }
+            a_file->index = new_index;
+            a_file->index_capacity = new_capacity;
+        }
+        memmove(&a_file->index[i + 1], &a_file->index[i], (a_file->n_index - i) * sizeof(history_index_entry_t));
+        a_file->n_index++;
+        memset(&a_file->index[i], 0, sizeof(history_index_entry_t));
+        a_file->index[i].path_hash = scan->path_hash;
+        a_file->index[i].filter_hash = scan->filter_hash;
+        a_file->index[i].parameter = scan->parameter;
+    }
+    a_file->index[i].offset = offset;
+}
+
+//
+// Read the side index; it is only usable if it describes no more of the
+// history file than is present.
+//
+void
+__history_index_load(
+    history_file_t  *a_file
+)
+{
+    history_index_header_t  header;
+    struct stat             finfo;
+    int                     fd = open(a_file->index_filename, O_RDONLY | O_CLOEXEC);
+    size_t                  index_size;
+
+    a_file->n_index = 0;
+    a_file->index_covered_size = 0;
+    if ( fd < 0 ) return;
+    if ( (fstat(fd, &finfo) != 0) || (read(fd, &header, sizeof(header)) != sizeof(header)) ) goto early_exit;
+    if ( memcmp(header.magic, HISTORY_INDEX_MAGIC, sizeof(HISTORY_INDEX_MAGIC)) || (header.version != HISTORY_INDEX_VERSION) ) goto early_exit;
+    index_size = header.n_entries * sizeof(history_index_entry_t);
+    if ( (uint64_t)finfo.st_size != sizeof(header) + index_size ) goto early_exit;
+    if ( (header.covered_size < sizeof(history_file_header_t)) || (header.covered_size > a_file->size) ) goto early_exit;
+
+    if ( header.n_entries > a_file->index_capacity ) {
+        history_index_entry_t   *new_index = (history_index_entry_t*)realloc(a_file->index, index_size);
+
+        if ( ! new_index ) {
+            perror("Unable to allocate history index");
+            exit(ENOMEM);
+        }
+        a_file->index = new_index;
+        a_file->index_capacity = header.n_entries;
+    }
+    if ( index_size && (read(fd, a_file->index, index_size) != (ssize_t)index_size) ) goto early_exit;
+    a_file->n_index = header.n_entries;
+    a_file->index_covered_size = header.covered_size;
+
+early_exit:
+    close(fd);
+}
 
-    if ( typeflag == FTW_DNR ) {
-        if ( is_verbose(verbosity_warning) ) fprintf(stderr, "[WARNING] cannot descend into directory: %s\n", fpath);
-        return 0;
+//
+// Bring the index up to date with the records appended since it was written
+// (or all records if it was unusable) and replace the index file.  Failure
+// is not fatal:  lookups just fall back to walking the history file.
+//
+bool
+__history_index_update(
+    history_file_t  *a_file,
+    const history_scan_header_t *new_scan,
+    uint64_t        new_offset
+)
+{
+    history_index_header_t  header;
+    const history_scan_header_t *scan;
+    uint64_t                offset = a_file->index_covered_size;
+    size_t                  tmp_filename_len = strlen(a_file->index_filename) + 5;
+    char                    *tmp_filename = (char*)malloc(tmp_filename_len);
+    size_t                  index_size;
+    int                     fd;
+    bool                    rc = false;
+
+    if ( ! tmp_filename ) {
+        perror("Unable to allocate history index filename");
+        exit(ENOMEM);
     }
-    if ( typeflag == FTW_NS ) {
-        if ( is_verbose(verbosity_warning) ) fprintf(stderr, "[WARNING] unresolvable symlink: %s\n", fpath);
-        return 0;
+    if ( ! offset ) {
+        a_file->n_index = 0;
+        offset = sizeof(history_file_header_t);
     }
+    while ( (offset < a_file->size) && (scan = __history_scan_at(a_file, offset)) ) {
+        __history_index_set(a_file, scan, offset);
+        offset += scan->record_size;
+    }
+    __history_index_set(a_file, new_scan, new_offset);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HISTORY_INDEX_MAGIC, sizeof(HISTORY_INDEX_MAGIC));
+    header.version = HISTORY_INDEX_VERSION;
+    header.n_entries = a_file->n_index;
+    header.covered_size = new_offset + new_scan->record_size;
+    index_size = a_file->n_index * sizeof(history_index_entry_t);
+
+    // Write a new index and rename it into place:
+    snprintf(tmp_filename, tmp_filename_len, "%s.tmp", a_file->index_filename);
+    fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if ( fd >= 0 ) {
+        if ( (write(fd, &header, sizeof(header)) == sizeof(header)) && (write(fd, a_file->index, index_size) == (ssize_t)index_size) && (fdatasync(fd) == 0) ) {
+            rc = ( rename(tmp_filename, a_file->index_filename) == 0 );
+        }
+        close(fd);
+        if ( ! rc ) unlink(tmp_filename);
+    }
+    if ( ! rc && is_verbose(verbosity_warning) ) fprintf(stderr, "[WARNING] Unable to update history index %s (errno = %d)\n", a_file->index_filename, errno);
+    free((void*)tmp_filename);
+    return rc;
+}
 
-    if ( is_verbose(verbosity_debug) && typeflag == FTW_D ) fprintf(stderr, "[DEBUG] %s\n", fpath);
-    
-    uint64_t        size;
-    
-    switch ( parameter ) {
-        case parameter_actual:
-            size = finfo->st_blocks * ST_NBLOCKSIZE;
-            break;
-        case parameter_size:
-            size = finfo->st_size;
-            break;
-        case parameter_blocks:
-            size = finfo->st_blocks;
-            break;
+//
+
+bool
+history_file_open(
+    history_file_t  *a_file,
+    const char      *filename,
+    bool            should_append
+)
+{
+    struct stat     finfo;
+    uint64_t        intact_size;
+
+    memset(a_file, 0, sizeof(*a_file));
+    a_file->fd = open(filename, should_append ? (O_RDWR | O_CREAT | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC), 0644);
+    if ( a_file->fd < 0 ) return false;
+
+    // Writers are serialized, readers only see complete records:
+    if ( flock(a_file->fd, should_append ? LOCK_EX : LOCK_SH) != 0 ) goto error_out;
+    if ( fstat(a_file->fd, &finfo) != 0 ) goto error_out;
+    a_file->size = finfo.st_size;
+
+    if ( a_file->size == 0 ) {
+        history_file_header_t   header;
+
+        if ( ! should_append ) return true;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, HISTORY_FILE_MAGIC, sizeof(HISTORY_FILE_MAGIC));
+        header.version = HISTORY_FILE_VERSION;
+        header.header_size = sizeof(header);
+        if ( pwrite(a_file->fd, &header, sizeof(header), 0) != sizeof(header) ) {
+            if ( ftruncate(a_file->fd, 0) ) {}
+            goto error_out;
+        }
+        a_file->size = sizeof(header);
     }
-    total_usage += size;
-    item_count++;
-    r = usage_tree_lookup_or_add(by_uid, finfo->st_uid);
-    if ( r ) r->byte_usage += size;
-    r = usage_tree_lookup_or_add(by_gid, finfo->st_gid);
-    if ( r ) r->byte_usage += size;
+    if ( a_file->size < sizeof(history_file_header_t) ) {
+        errno = EINVAL;
+        goto error_out;
+    }
+    a_file->base = (const char*)mmap(NULL, a_file->size, PROT_READ, MAP_SHARED, a_file->fd, 0);
+    if ( a_file->base == (const char*)MAP_FAILED ) {
+        a_file->base = NULL;
+        goto error_out;
+    }
+    a_file->mapped_size = a_file->size;
 
-    if ( (item_count % progress_stride) == 0 ) {
-        if ( is_verbose(verbosity_info) ) {
-            fprintf(stderr, "[INFO]   %12llu items scanned...\n", (unsigned long long)item_count);
-        } else {
-            printf("... %llu items scanned...\n", (unsigned long long)item_count);
+    const history_file_header_t *header = (const history_file_header_t*)a_file->base;
+
+    if ( memcmp(header->magic, HISTORY_FILE_MAGIC, sizeof(HISTORY_FILE_MAGIC)) || (header->version != HISTORY_FILE_VERSION) || (header->header_size != sizeof(*header)) ) {
+        errno = EINVAL;
+        goto error_out;
+    }
+
+    // A crash mid-append leaves a torn record at the end of the file:
+    intact_size = __history_intact_size(a_file);
+    if ( intact_size != a_file->size ) {
+        if ( should_append ) {
+            // Shown by default since scan results are being discarded:
+            if ( is_verbose(verbosity_error) ) fprintf(stderr, "[WARNING] Truncating %llu bytes of damaged records from the end of history file %s\n", (unsigned long long)(a_file->size - intact_size), filename);
+            if ( ftruncate(a_file->fd, intact_size) != 0 ) goto error_out;
+        } else if ( is_verbose(verbosity_warning) ) {
+            fprintf(stderr, "[WARNING] Ignoring %llu bytes of damaged records at the end of history file %s\n", (unsigned long long)(a_file->size - intact_size), filename);
+        }
+        a_file->size = intact_size;
+    }
+
+    a_file->index_filename = (char*)malloc(strlen(filename) + sizeof(HISTORY_INDEX_SUFFIX));
+    if ( ! a_file->index_filename ) {
+        perror("Unable to allocate history index filename");
+        exit(ENOMEM);
+    }
+    strcpy(a_file->index_filename, filename);
+    strcat(a_file->index_filename, HISTORY_INDEX_SUFFIX);
+    __history_index_load(a_file);
+    return true;
+
+error_out:
+    {
+        int         saved_errno = errno;
+
+        if ( a_file->base ) munmap((void*)a_file->base, a_file->mapped_size ? a_file->mapped_size : a_file->size);
+        close(a_file->fd);
+        a_file->fd = -1;
+        a_file->base = NULL;
+        errno = saved_errno;
+    }
+    return false;
+}
+
+void
+history_file_close(
+    history_file_t  *a_file
+)
+{
+    if ( a_file->base ) munmap((void*)a_file->base, a_file->mapped_size);
+    if ( a_file->fd >= 0 ) close(a_file->fd);
+    if ( a_file->index ) free((void*)a_file->index);
+    if ( a_file->index_filename ) free((void*)a_file->index_filename);
+    memset(a_file, 0, sizeof(*a_file));
+    a_file->fd = -1;
+}
+
+//
+// Walk backwards from the end of the file through the records not covered
+// by the index, then consult the index, to find the most recent scan of the
+// path; returns its offset or 0 if there is none.  Returns -1 if the file
+// is damaged.
+//
+int64_t
+history_find_latest(
+    const history_file_t    *a_file,
+    const char              *path,
+    uint64_t                path_hash,
+    uint64_t                filter_hash
+)
+{
+    uint64_t                end = a_file->size;
+    uint64_t                covered_size = a_file->index_covered_size;
+
+    while ( end > sizeof(history_file_header_t) ) {
+        const history_scan_trailer_t    *trailer;
+        const history_scan_header_t     *scan;
+
+        if ( covered_size && (end == covered_size) ) {
+            bool            is_found;
+            unsigned int    i = __history_index_search(a_file, path_hash, filter_hash, parameter, &is_found);
+
+            if ( ! is_found ) return 0;
+            if ( (a_file->index[i].offset < covered_size) && (scan = __history_scan_at(a_file, a_file->index[i].offset)) && __history_scan_matches(scan, path, path_hash, filter_hash) ) return a_file->index[i].offset;
+
+            // A stale index or a hash collision, so keep walking:
+            covered_size = 0;
         }
+        if ( (end & 7) || (end < sizeof(history_file_header_t) + sizeof(history_scan_header_t) + sizeof(history_scan_trailer_t)) ) return -1;
+        trailer = (const history_scan_trailer_t*)(a_file->base + end - sizeof(history_scan_trailer_t));
+        if ( (trailer->magic != HISTORY_TRAILER_MAGIC) || (trailer->record_size > end - sizeof(history_file_header_t)) ) return -1;
+        end -= trailer->record_size;
+        if ( ! (scan = __history_scan_at(a_file, end)) || (scan->record_size != trailer->record_size) ) return -1;
+        if ( __history_scan_matches(scan, path, path_hash, filter_hash) ) return end;
+
+        // The index does not sit on a record boundary:
+        if ( end < covered_size ) covered_size = 0;
     }
     return 0;
 }
 
+//
+// Follow the chain of scans of the path back to the most recent one made
+// at or before the given time (or the most recent of all if the time is 0).
+//
+const history_scan_header_t*
+history_find_scan(
+    const history_file_t    *a_file,
+    const char              *path,
+    time_t                  when,
+    bool                    *is_damaged
+)
+{
+    uint64_t                path_hash = __fnv1a_hash(FNV1A_HASH_INIT, path, strlen(path));
+    uint64_t                filter_hash = filter_signature();
+    int64_t                 offset = history_find_latest(a_file, path, path_hash, filter_hash);
+    const history_scan_header_t *scan = NULL;
+
+    *is_damaged = ( offset < 0 );
+    while ( offset > 0 ) {
+        if ( ! (scan = __history_scan_at(a_file, offset)) || ! __history_scan_matches(scan, path, path_hash, filter_hash) ) {
+            *is_damaged = true;
+            return NULL;
+        }
+        if ( (when == 0) || (scan->scan_time <= when) ) return scan;
+        // Chains only ever point backwards:
+        if ( scan->previous_offset >= (uint64_t)offset ) {
+            *is_damaged = true;
+            return NULL;
+        }
+        offset = scan->previous_offset;
+    }
+    return NULL;
+}
+
+//
+
+int
+__history_entry_compare_by_entity_id(
+    const void      *e1,
+    const void      *e2
+)
+{
+    int32_t         i1 = ((const history_entry_t*)e1)->entity_id;
+    int32_t         i2 = ((const history_entry_t*)e2)->entity_id;
+
+    return ( i1 < i2 ) ? -1 : ( ( i1 > i2 ) ? 1 : 0 );
+}
+
+unsigned int
+usage_tree_to_history_entries(
+    usage_tree_t    *a_tree,
+    history_entry_t *entries
+)
+{
+    usage_record_t  *r = a_tree->as_list;
+    unsigned int    n = 0;
+
+    while ( r ) {
+        if ( entries ) {
+            entries[n].entity_id = r->entity_id;
+            entries[n].reserved = 0;
+            entries[n].byte_usage = r->byte_usage;
+        }
+        n++;
+        r = r->list;
+    }
+    if ( entries ) qsort(entries, n, sizeof(history_entry_t), __history_entry_compare_by_entity_id);
+    return n;
+}
+
+//
+
+bool
+history_append(
+    const char      *filename,
+    const char      *path
+)
+{
+    history_file_t          history;
+    history_scan_header_t   *scan;
+    history_scan_trailer_t  *trailer;
+    size_t                  path_length = __history_path_length(path);
+    unsigned int            n_uids = usage_tree_to_history_entries(by_uid, NULL);
+    unsigned int            n_gids = usage_tree_to_history_entries(by_gid, NULL);
+    size_t                  record_size = sizeof(history_scan_header_t) + path_length + (n_uids + n_gids) * sizeof(history_entry_t) + sizeof(history_scan_trailer_t);
+    char                    *record;
+    int64_t                 previous_offset;
+    bool                    rc = false;
+
+    if ( ! history_file_open(&history, filename, true) ) {
+        if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] Unable to open history file %s (errno = %d)\n", filename, errno);
+        return false;
+    }
+
+    record = (char*)malloc(record_size);
+    if ( ! record ) {
+        perror("Unable to allocate history record");
+        exit(ENOMEM);
+    }
+    memset(record, 0, record_size);
+    scan = (history_scan_header_t*)record;
+    scan->magic = HISTORY_SCAN_MAGIC;
+    scan->parameter = parameter;
+    scan->record_size = record_size;
+    scan->path_hash = __fnv1a_hash(FNV1A_HASH_INIT, path, strlen(path));
+    scan->filter_hash = filter_signature();
+    scan->scan_time = scan_time;
+    scan->total_usage = total_usage;
+    scan->item_count = item_count;
+    scan->path_length = path_length;
+    scan->n_uids = n_uids;
+    scan->n_gids = n_gids;
+    strcpy((char*)(scan + 1), path);
+    usage_tree_to_history_entries(by_uid, (history_entry_t*)(record + sizeof(history_scan_header_t) + path_length));
+    usage_tree_to_history_entries(by_gid, (history_entry_t*)(record + sizeof(history_scan_header_t) + path_length) + n_uids);
+    trailer = (history_scan_trailer_t*)(record + record_size - sizeof(history_scan_trailer_t));
+    trailer->record_size = record_size;
+    trailer->magic = HISTORY_TRAILER_MAGIC;
+
+    previous_offset = history_find_latest(&history, path, scan->path_hash, scan->filter_hash);
+    if ( previous_offset < 0 ) {
+        if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] History file %s is damaged, not appending\n", filename);
+    } else {
+        scan->previous_offset = previous_offset;
+        if ( (pwrite(history.fd, record, record_size, history.size) == (ssize_t)record_size) && (fdatasync(history.fd) == 0) ) {
+            rc = true;
+            if ( is_verbose(verbosity_info) ) fprintf(stderr, "[INFO] Appended scan of %s to history file %s\n", path, filename);
+            __history_index_update(&history, scan, history.size);
+        } else {
+            // Never leave a partial record behind:
+            if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] Unable to append to history file %s (errno = %d)\n", filename, errno);
+            if ( ftruncate(history.fd, history.size) ) {}
+        }
+    }
+    free((void*)record);
+    history_file_close(&history);
+    return rc;
+}
+
+//
+
+typedef struct usage_delta {
+    int32_t         entity_id;
+    uint64_t        previous_usage, current_usage;
+    int64_t         delta;
+} usage_delta_t;
+
+int
+__usage_delta_compare(
+    const void      *d1,
+    const void      *d2
+)
+{
+    int64_t         v1 = ((const usage_delta_t*)d1)->delta;
+    int64_t         v2 = ((const usage_delta_t*)d2)->delta;
+
+    return ( v1 > v2 ) ? -1 : ( ( v1 < v2 ) ? 1 : 0 );
+}
+
+const char*
+__usage_to_string(
+    uint64_t        usage,
+    char            *buffer,
+    size_t          buffer_len
+)
+{
+    if ( should_show_human_readable && (parameter != parameter_blocks) ) {
+        snprintf(buffer, buffer_len, "%s", byte_count_to_string(usage));
+    } else {
+        snprintf(buffer, buffer_len, "%llu", (unsigned long long)usage);
+    }
+    return buffer;
+}
+
+const char*
+__usage_delta_to_string(
+    int64_t         delta,
+    char            *buffer,
+    size_t          buffer_len
+)
+{
+    buffer[0] = ( delta < 0 ) ? '-' : '+';
+    __usage_to_string(( delta < 0 ) ? -(uint64_t)delta : (uint64_t)delta, buffer + 1, buffer_len - 1);
+    return buffer;
+}
+
+void
+__usage_delta_print(
+    const usage_delta_t     *d,
+    entity_id_to_name_fn    entity_to_name
+)
+{
+    const char      *name = NULL;
+    char            delta_str[32], previous_str[32], current_str[32];
+
+    if ( entity_to_name ) name = entity_to_name(d->entity_id);
+    __usage_delta_to_string(d->delta, delta_str, sizeof(delta_str));
+    __usage_to_string(d->previous_usage, previous_str, sizeof(previous_str));
+    __usage_to_string(d->current_usage, current_str, sizeof(current_str));
+    if ( name ) {
+        printf("%20s %24s %24s %24s\n", name, delta_str, previous_str, current_str);
+    } else {
+        printf("%20d %24s %24s %24s\n", d->entity_id, delta_str, previous_str, current_str);
+    }
+}
+
+void
+usage_tree_diff_summarize(
+    usage_tree_t            *a_tree,
+    const history_entry_t   *previous,
+    unsigned int            n_previous,
+    const char              *label,
+    const char              *root_path
+)
+{
+    unsigned int            n_current = usage_tree_to_history_entries(a_tree, NULL);
+    history_entry_t         *current = (history_entry_t*)malloc((n_current + 1) * sizeof(history_entry_t));
+    usage_delta_t           *deltas = (usage_delta_t*)malloc((n_current + n_previous + 1) * sizeof(usage_delta_t));
+    unsigned int            i = 0, j = 0, n_deltas = 0, k, shown;
+
+    if ( ! current || ! deltas ) {
+        perror("Unable to allocate usage deltas");
+        exit(ENOMEM);
+    }
+    usage_tree_to_history_entries(a_tree, current);
+
+    // Both lists are sorted by entity id, so merge them:
+    while ( (i < n_previous) || (j < n_current) ) {
+        usage_delta_t       *d = &deltas[n_deltas++];
+
+        if ( (j >= n_current) || ((i < n_previous) && (previous[i].entity_id < current[j].entity_id)) ) {
+            d->entity_id = previous[i].entity_id;
+            d->previous_usage = previous[i++].byte_usage;
+            d->current_usage = 0;
+        }
+        else if ( (i >= n_previous) || (current[j].entity_id < previous[i].entity_id) ) {
+            d->entity_id = current[j].entity_id;
+            d->previous_usage = 0;
+            d->current_usage = current[j++].byte_usage;
+        }
+        else {
+            d->entity_id = current[j].entity_id;
+            d->previous_usage = previous[i++].byte_usage;
+            d->current_usage = current[j++].byte_usage;
+        }
+        d->delta = (int64_t)(d->current_usage - d->previous_usage);
+    }
+    qsort(deltas, n_deltas, sizeof(usage_delta_t), __usage_delta_compare);
+
+    printf("\nBiggest growers by-%s for %s:\n", label, root_path);
+    for ( k = 0, shown = 0; (k < n_deltas) && (shown < diff_count) && (deltas[k].delta > 0); k++, shown++ ) __usage_delta_print(&deltas[k], a_tree->entity_to_name);
+    printf("\nBiggest shrinkers by-%s for %s:\n", label, root_path);
+    for ( k = n_deltas, shown = 0; (k > 0) && (shown < diff_count) && (deltas[k - 1].delta < 0); k--, shown++ ) __usage_delta_print(&deltas[k - 1], a_tree->entity_to_name);
+
+    free((void*)deltas);
+    free((void*)current);
+}
+
+bool
+history_diff_summarize(
+    const char      *filename,
+    const char      *path,
+    const char      *root_path
+)
+{
+    history_file_t              history;
+    const history_scan_header_t *scan;
+    bool                        is_damaged;
+
+    if ( ! history_file_open(&history, filename, false) ) {
+        if ( errno == ENOENT ) {
+            if ( is_verbose(verbosity_warning) ) fprintf(stderr, "[WARNING] No history file %s to compare against\n", filename);
+            return true;
+        }
+        if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] Unable to open history file %s (errno = %d)\n", filename, errno);
+        return false;
+    }
+    scan = history.base ? history_find_scan(&history, path, diff_against_time, &is_damaged) : NULL;
+    if ( scan ) {
+        const history_entry_t   *entries = (const history_entry_t*)((const char*)(scan + 1) + scan->path_length);
+        time_t                  then = (time_t)scan->scan_time;
+        char                    then_str[64], delta_str[32], previous_str[32], current_str[32];
+
+        strftime(then_str, sizeof(then_str), "%Y-%m-%d %H:%M:%S", localtime(&then));
+        printf("\nChanges since %s for %s:\n", then_str, root_path);
+        printf("%20s %24s %24s %24s\n", "", "change", "previous", "current");
+        __usage_delta_to_string((int64_t)(total_usage - scan->total_usage), delta_str, sizeof(delta_str));
+        __usage_to_string(scan->total_usage, previous_str, sizeof(previous_str));
+        __usage_to_string(total_usage, current_str, sizeof(current_str));
+        printf("%20s %24s %24s %24s\n", "(total)", delta_str, previous_str, current_str);
+
+        usage_tree_diff_summarize(by_uid, entries, scan->n_uids, "user", root_path);
+        usage_tree_diff_summarize(by_gid, entries + scan->n_uids, scan->n_gids, "group", root_path);
+    }
+    else if ( history.base && is_damaged ) {
+        if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] History file %s is damaged\n", filename);
+        history_file_close(&history);
+        return false;
+    }
+    else if ( is_verbose(verbosity_warning) ) {
+        fprintf(stderr, "[WARNING] No previous scan of %s in history file %s to compare against\n", path, filename);
+    }
+    history_file_close(&history);
+    return true;
+}
+
 //
 
 void
@@ -568,18 +2522,133 @@ usage(
             "                                 actual      bytes on disk (the default)\n"
             "                                 size        nominal size (possibly sparse)\n"
             "                                 blocks      block count\n"
+            "    --profile/-t <name>      traversal profile to use (default: auto, which\n"
+            "                             selects by the file system type of each <path>):\n\n",
+            exe,
+            (unsigned long long int)DEFAULT_PROGRESS_STRIDE
+        );
+
+    const traversal_profile_t   *P = traversal_profiles;
+
+    while ( P->name ) {
+        printf("                                 %-11s %s\n", P->name, P->description);
+        P++;
+    }
+    printf(
+            "\n"
+            "    --tune/-T <key>=<value>  override a setting of the traversal profile:\n\n"
+            "                                 batch       entries stat'd per batch\n"
+            "                                 sort        sort batches by inode (yes/no)\n"
+            "                                 concurrency threads issuing stat() (max %d)\n"
+            "                                 fds         directory descriptors held open\n"
+            "                                 noatime     open directories with O_NOATIME\n"
+            "                                             (yes/no)\n\n"
+            "    --benchmark/-B           traverse each <path> once per profile and display\n"
+            "                             timings rather than usage; a comma-separated list\n"
+            "                             of profiles can be given via --profile/-t (default:\n"
+            "                             all profiles).  Later traversals benefit from\n"
+            "                             caches warmed by earlier ones.\n"
+            "\n"
+            "  filtering options (may be repeated):\n\n"
+            "    --exclude/-x <pattern>   do not account or descend into entries matching\n"
+            "                             the glob <pattern>; excluded directories are\n"
+            "                             pruned without being stat'd\n"
+            "    --include/-i <pattern>   only account entries matching the glob <pattern>\n"
+            "                             (directories are still descended)\n"
+            "    --min-size/-s #[KMGTP]   only account entries with a nominal size of at\n"
+            "                             least # bytes\n"
+            "    --older-than/-o #[smhdw] only account entries last modified more than #\n"
+            "                             units ago (default unit: days)\n"
+            "    --user/-u <u>{,<u>..}    only account entries owned by the given user(s)\n"
+            "    --group/-g <g>{,<g>..}   only account entries owned by the given group(s)\n"
+            "\n"
+            "  A <pattern> containing a '/' is matched against the full path of an entry,\n"
+            "  otherwise it is matched against the entry's name, e.g. '*/.snapshot' or\n"
+            "  '.snapshot'.\n"
+            "\n"
+            "  history options:\n\n"
+            "    --history/-d <file>      append the results of each scan to the history\n"
+            "                             <file> (not done with --benchmark/-B)\n"
+            "    --diff-against/-D <when> show the biggest growers and shrinkers since the\n"
+            "                             scan of the same <path> in the history <file>\n"
+            "                             selected by <when>:\n\n"
+            "                                 last        the most recent scan\n"
+            "                                 #[smhdw]    the most recent scan at least #\n"
+            "                                             units (default: days) ago\n"
+            "                                 YYYY-MM-DD{THH:MM{:SS}}\n"
+            "                                             the most recent scan at or before\n"
+            "                                             the given date/time\n\n"
+            "    --diff-count/-N #        number of growers and shrinkers to show\n"
+            "                             (default: %d)\n"
             "\n"
             "  <path> can be an absolute or relative file system path to a directory or\n"
             "  file (not very interesting), and for each <path> the traversal is repeated\n"
             "  (rather than aggregating the sum over the paths).\n"
             "\n",
-            exe,
-            (unsigned long long int)DEFAULT_PROGRESS_STRIDE            
+            MAX_CONCURRENCY,
+            DEFAULT_DIFF_COUNT
         );
 }
 
 //
 
+int
+scan_path(
+    const char      *root_path,
+    int             profile,
+    double          *seconds
+)
+{
+    struct timespec start_time, end_time;
+    int             rc;
+
+    select_profile(root_path, profile);
+
+    // Initialize the two summary trees:
+    if ( is_verbose(verbosity_debug) ) fprintf(stderr, "[DEBUG] Allocating by-uid tree\n");
+    by_uid = usage_tree_create(should_show_numeric_entity_ids ? NULL : uid_to_uname);
+
+    if ( is_verbose(verbosity_debug) ) fprintf(stderr, "[DEBUG] Allocating by-gid tree\n");
+    by_gid = usage_tree_create(should_show_numeric_entity_ids ? NULL : gid_to_gname);
+
+    // Initialize global counters, too:
+    total_usage = 0;
+    item_count = 0;
+
+    // Walk the directory hierarchy:
+    if ( is_verbose(verbosity_info) ) fprintf(stderr, "[INFO] Starting traversal of %s\n", root_path);
+    scan_time = time(NULL);
+    clock_gettime(CLOCK_BOOTTIME, &start_time);
+    if ( active_profile.should_use_nftw ) {
+        rc = nftw(root_path, nftw_callback, active_profile.max_open_fds, FTW_MOUNT | FTW_PHYS | FTW_ACTIONRETVAL);
+    } else {
+        rc = walk(root_path);
+    }
+    clock_gettime(CLOCK_BOOTTIME, &end_time);
+    *seconds = (end_time.tv_sec - start_time.tv_sec) + 1e-9 * (end_time.tv_nsec - start_time.tv_nsec);
+    if ( is_verbose(verbosity_info) ) {
+        fprintf(stderr, "[INFO] Completed traversal of %s\n", root_path);
+        fprintf(stderr, "[INFO]   %llu files/directories in %.3f seconds\n", (unsigned long long int)item_count, *seconds);
+        fprintf(stderr, "[INFO]   %12.0f files/directories per second\n", (double)item_count / *seconds);
+    }
+    if ( is_verbose(verbosity_error) && (rc != 0) ) fprintf(stderr, "[ERROR] Directory walk exited early due to internal failure\n");
+    return rc;
+}
+
+//
+
+void
+scan_path_cleanup(void)
+{
+    // Destroy the summary trees:
+    if ( is_verbose(verbosity_debug) ) fprintf(stderr, "[DEBUG] Deallocating by-uid tree\n");
+    usage_tree_destroy(by_uid);
+    if ( is_verbose(verbosity_debug) ) fprintf(stderr, "[DEBUG] Deallocating by-gid tree\n");
+    usage_tree_destroy(by_gid);
+}
+
+//
+
 int
 main(
     int             argc,
@@ -632,40 +2701,117 @@ main(
                 }
                 break;
 
+            case 't':
+                if ( ! set_profiles(optarg) ) {
+                    if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] Invalid argument to --profile/-t: %s\n", optarg);
+                    exit(EINVAL);
+                }
+                break;
+
+            case 'T':
+                if ( ! set_profile_tuning(optarg) ) {
+                    if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] Invalid argument to --tune/-T: %s\n", optarg);
+                    exit(EINVAL);
+                }
+                break;
+
+            case 'B':
+                should_benchmark = true;
+                break;
+
+            case 'i':
+            case 'x':
+                if ( ! add_filter_pattern(optarg, (opt == 'x')) ) {
+                    if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] Invalid argument to --%s/-%c: %s\n", (opt == 'x') ? "exclude" : "include", opt, optarg);
+                    exit(EINVAL);
+                }
+                break;
+
+            case 's':
+                if ( ! set_filter_min_size(optarg) ) {
+                    if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] Invalid argument to --min-size/-s: %s\n", optarg);
+                    exit(EINVAL);
+                }
+                break;
+
+            case 'o':
+                if ( ! set_filter_older_than(optarg) ) {
+                    if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] Invalid argument to --older-than/-o: %s\n", optarg);
+                    exit(EINVAL);
+                }
+                break;
+
+            case 'u':
+            case 'g':
+                if ( ! add_filter_entities(optarg, (opt == 'g')) ) {
+                    if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] Invalid argument to --%s/-%c: %s\n", (opt == 'g') ? "group" : "user", opt, optarg);
+                    exit(EINVAL);
+                }
+                break;
+
+            case 'd':
+                history_filename = optarg;
+                break;
+
+            case 'D':
+                if ( ! set_diff_against(optarg) ) {
+                    if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] Invalid argument to --diff-against/-D: %s\n", optarg);
+                    exit(EINVAL);
+                }
+                break;
+
+            case 'N':
+                if ( ! __parse_unsigned(optarg, 1, UINT_MAX, &diff_count) ) {
+                    if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] Invalid argument to --diff-count/-N: %s\n", optarg);
+                    exit(EINVAL);
+                }
+                break;
+
         }
     }
 
     // Increase our nice level (lowest priority possible, please):
     if ( geteuid() != 0 ) nice(999);
 
-    while ( (rc == 0) && (optind < argc) ) {
-        const char      *root_path = argv[optind];
-        struct timespec start_time, end_time;
-
-        // Initialize the two summary trees:
-        if ( is_verbose(verbosity_debug) ) fprintf(stderr, "[DEBUG] Allocating by-uid tree\n");
-        by_uid = usage_tree_create(should_show_numeric_entity_ids ? NULL : uid_to_uname);
-
-        if ( is_verbose(verbosity_debug) ) fprintf(stderr, "[DEBUG] Allocating by-gid tree\n");
-        by_gid = usage_tree_create(should_show_numeric_entity_ids ? NULL : gid_to_gname);
+    filter_compile();
 
-        // Initialize global counters, too:
-        total_usage = 0;
-        item_count = 0;
+    if ( should_diff && ! history_filename ) {
+        if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] --diff-against/-D requires a --history/-d file\n");
+        exit(EINVAL);
+    }
 
-        // Walk the directory hierarchy:
-        if ( is_verbose(verbosity_info) ) fprintf(stderr, "[INFO] Starting traversal of %s\n", root_path);
-        clock_gettime(CLOCK_BOOTTIME, &start_time);
-        rc = nftw(root_path, (should_show_progress ? nftw_progress_callback : nftw_callback), 100, FTW_MOUNT | FTW_PHYS);
-        clock_gettime(CLOCK_BOOTTIME, &end_time);
-        if ( is_verbose(verbosity_info) ) {
-            double      seconds = (end_time.tv_sec - start_time.tv_sec) + 1e-9 * (end_time.tv_nsec - start_time.tv_nsec);
+    if ( (selected_profile_count > 1) && ! should_benchmark ) {
+        if ( is_verbose(verbosity_error) ) fprintf(stderr, "[ERROR] Multiple traversal profiles are only valid with --benchmark/-B\n");
+        exit(EINVAL);
+    }
+    if ( should_benchmark && (selected_profile_count == 1) && (selected_profiles[0] == profile_auto) ) {
+        // Benchmark every profile:
+        for ( selected_profile_count = 0; selected_profile_count < profile_max; selected_profile_count++ ) selected_profiles[selected_profile_count] = selected_profile_count;
+    }
 
-            fprintf(stderr, "[INFO] Completed traversal of %s\n", root_path);
-            fprintf(stderr, "[INFO]   %llu files/directories in %.3f seconds\n", (unsigned long long int)item_count, seconds);
-            fprintf(stderr, "[INFO]   %12.0f files/directories per second\n", (double)item_count / seconds);
+    while ( (rc == 0) && (optind < argc) ) {
+        const char      *root_path = argv[optind];
+        double          seconds;
+
+        if ( should_benchmark ) {
+            unsigned int    i;
+
+            printf("Traversal benchmark for %s:\n", root_path);
+            printf("%-12s %12s %12s %14s %24s\n", "profile", "items", "seconds", "items/second", "total usage");
+            for ( i = 0; (rc == 0) && (i < selected_profile_count); i++ ) {
+                rc = scan_path(root_path, selected_profiles[i], &seconds);
+                printf("%-12s %12llu %12.3f %14.0f %24llu\n",
+                        active_profile.name, (unsigned long long)item_count, seconds,
+                        (double)item_count / seconds, (unsigned long long)total_usage
+                    );
+                scan_path_cleanup();
+            }
+            optind++;
+            if ( optind < argc ) printf("\n");
+            continue;
         }
-        if ( is_verbose(verbosity_error) && (rc != 0) ) fprintf(stderr, "[ERROR] Directory walk exited early due to internal failure\n");
+
+        rc = scan_path(root_path, selected_profiles[0], &seconds);
 
         // Sumarize:
         printf("Total usage:\n");
@@ -710,11 +2856,17 @@ main(
             usage_tree_summarize(by_gid, tree_by_entity_id);
         }
 
-        // Destroy the summary trees:
-        if ( is_verbose(verbosity_debug) ) fprintf(stderr, "[DEBUG] Deallocating by-uid tree\n");
-        usage_tree_destroy(by_uid);
-        if ( is_verbose(verbosity_debug) ) fprintf(stderr, "[DEBUG] Deallocating by-gid tree\n");
-        usage_tree_destroy(by_gid);
+        // Compare against and then record in the history file:
+        if ( history_filename && (rc == 0) ) {
+            char        *canonical_path = realpath(root_path, NULL);
+            const char  *history_path = canonical_path ? canonical_path : root_path;
+
+            if ( should_diff && ! history_diff_summarize(history_filename, history_path, root_path) ) rc = EINVAL;
+            if ( ! history_append(history_filename, history_path) ) rc = EIO;
+            if ( canonical_path ) free((void*)canonical_path);
+        }
+
+        scan_path_cleanup();
 
         // Move on to the next path to scan:
         optind++;